@@ -0,0 +1,103 @@
+/* Online thermal model and degradation watch
+ * NLMS model dy = w_out*u + w_temp*(y-512) + w_bias*64 on the raw reading (Q6 steps); the residual's fast mean and
+ * energy are checked against slow baselines of their own spread, learned while nothing is wrong
+ * Pure function on a struct anom_state, so test/anom_sim.c runs the same code on a host
+ *
+ * Feed it the unfiltered reading: differences of a low-passed reading are strongly correlated from sample to
+ * sample, the fast mean of their residual then swings far wider than white noise would let it
+ */
+
+#ifndef ANOM_MODEL_H
+#define ANOM_MODEL_H
+
+#include "filter_adapt.h"      // AF_SHIFT, the Q6 reading format
+
+#define ANOM_W_SHIFT 32        // Weights in Q32, small NLMS steps must not truncate to 0
+#define ANOM_MU_SHIFT 16       // NLMS step 2^-16, adapts over days of samples at ~5 main loop passes per second
+#define ANOM_MU_SHIFT_WARM 10  // NLMS step 2^-10 while warming up
+#define ANOM_FAST_DIV 64       // Residual energy EWMA, ~13s
+#define ANOM_MEAN_DIV 256      // Residual mean EWMA, ~50s; longer than the energy's, a weak heater moves the mean only
+#define ANOM_AVG_DIV 16        // Reading average for the temperature input, keeps the ADC jitter out of the regressor
+#define ANOM_SLOW_DIV 4096     // Baselines of the residual energy and of the squared fast mean, EWMA ~15min
+#define ANOM_K2 36             // Warn at 6 sigma of the mean's measured spread, anom_sim: moves <= 16^2, drop >= 73
+#define ANOM_MEAN_FLOOR 4      // Q16, smallest squared spread of the mean, 1/128 step per sample; for a noise-free input
+#define ANOM_RATIO 4           // or when the fast residual energy exceeds this many times the baseline
+#define ANOM_WARMUP 18000      // Samples (~1h) of model training before any warning
+
+struct anom_state {           // Online thermal model and residual statistics
+    long long w[3];          // Weights for output, temperature and bias, Q32
+    long y_prev;             // Last reading, Q6
+    long y_avg;              // EWMA of the reading, Q6
+    unsigned int u;          // Output applied since y_prev, Q8 (256: P1.6 driven)
+    long res_mean;           // EWMA of the residual, Q6, kept times ANOM_MEAN_DIV so it does not stall
+    unsigned long res_fast;  // Fast EWMA of the squared residual, Q12, times ANOM_FAST_DIV
+    unsigned long long res_var; // Slow EWMA of the squared residual (baseline), Q12, times ANOM_SLOW_DIV
+    long mean_slow;          // Slow EWMA of the residual mean, the model's own bias, Q8, times ANOM_SLOW_DIV
+    unsigned long long mean_var; // Slow EWMA of the mean's squared deviation from mean_slow, Q16, times ANOM_SLOW_DIV
+    unsigned int samples;    // Saturates at ANOM_WARMUP
+    unsigned int warn;
+};
+
+
+static unsigned int anom_update(struct anom_state *a, long y) { // One NLMS step and residual update, fixed cost
+    long x[3], err = 0, mean = 0;                                 // per sample; returns 1 when a warning starts
+    long long pred = 0;
+    unsigned long norm = 0, sq = 0, fast = 0, var = 0, dev = 0, limit = 0;
+    unsigned int i = 0, warn = 0, mu = ANOM_MU_SHIFT;
+
+    if (a->y_prev < 0) {
+        a->y_avg = y;
+        a->y_prev = y;
+        return 0;
+    }
+    x[0] = a->u;                                     // Output, Q8
+    x[1] = (a->y_avg >> AF_SHIFT) - 512;             // Temperature, centered ADC steps
+    x[2] = 64;                                       // Bias
+    for (i = 0; i < 3; i++) {
+        pred += a->w[i] * x[i];
+        norm += x[i] * x[i];
+    }
+    err = (y - a->y_prev) - (long)(pred >> ANOM_W_SHIFT); // Measured minus predicted change, Q6
+    if (err > 4095)                                  // 64 steps per sample, keeps the EWMA sums in 32 bits
+        err = 4095;
+    else if (err < -4095)
+        err = -4095;
+    if (a->samples < ANOM_WARMUP)
+        mu = ANOM_MU_SHIFT_WARM;
+    for (i = 0; i < 3; i++)
+        a->w[i] += (long long)err * x[i] * (1LL << (ANOM_W_SHIFT - mu)) / (long)norm;
+    a->y_prev = y;
+    a->y_avg += (y - a->y_avg) / ANOM_AVG_DIV;
+
+    sq = err * err;
+    a->res_mean += err - a->res_mean / ANOM_MEAN_DIV;
+    a->res_fast += sq - a->res_fast / ANOM_FAST_DIV;
+    mean = a->res_mean / (ANOM_MEAN_DIV / 4) - a->mean_slow / ANOM_SLOW_DIV; // Change of the mean, Q8
+    dev = mean * mean;                               // Q16
+    if (a->samples < ANOM_WARMUP) {
+        a->samples += 1;
+        a->res_var = (unsigned long long)a->res_fast * (ANOM_SLOW_DIV / ANOM_FAST_DIV); // Follow while settling
+        a->mean_slow += mean;
+        a->mean_var += dev - a->mean_var / ANOM_SLOW_DIV;
+        return 0;
+    }
+    fast = a->res_fast / ANOM_FAST_DIV;
+    var = a->res_var / ANOM_SLOW_DIV;
+    limit = a->mean_var / ANOM_SLOW_DIV;
+    if (limit < ANOM_MEAN_FLOOR)
+        limit = ANOM_MEAN_FLOOR;
+    if (a->warn)                                     // Hysteresis, clears at half the trigger level
+        warn = dev / ANOM_K2 > limit / 4 || fast > var * ANOM_RATIO / 2;
+    else
+        warn = dev / ANOM_K2 > limit || fast > var * ANOM_RATIO;
+    if (!a->warn) {   // Hold the baselines while warning, so the fault does not become the new normal; the spread
+        a->res_var += sq - a->res_var / ANOM_SLOW_DIV; // takes at most 2 sigma per sample, a mean still on its
+        a->mean_slow += mean;                          // way up to the warning must not widen its own limit
+        a->mean_var += (dev < limit * 4 ? dev : limit * 4) - a->mean_var / ANOM_SLOW_DIV;
+    }
+    i = warn && !a->warn;
+    a->warn = warn;
+    return i;
+}
+
+#endif
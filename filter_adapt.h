@@ -0,0 +1,36 @@
+/* Adaptive-bandwidth reading filter
+ * IIR whose coefficient rises with the smoothed innovation (One-Euro style), alpha in Q8
+ * Pure function on a struct filter_state, so test/filter_bench.c runs the same code on a host
+ */
+
+#ifndef FILTER_ADAPT_H
+#define FILTER_ADAPT_H
+
+#define AF_SHIFT 6             // State is ADC steps in Q6
+#define AF_ALPHA_MIN 16        // Steady-state alpha, 1/16
+#define AF_BETA 4              // Alpha added per ADC step of smoothed innovation, below 1/4 step it adds nothing
+#define AF_SLOPE_DIV 128       // Innovation smoothing, noise averages out, a ramp does not; tuned with
+                               // test/filter_bench.c so steady-state noise stays at the fixed 1/16 IIR's
+
+struct filter_state {        // Adaptive filter state, Q6
+    long y;                  // Output
+    long slope;              // Smoothed innovation, tracks the rate of change
+};
+
+
+static unsigned int filter_adapt(struct filter_state *f, unsigned int x) { // One step, O(1), returns ADC steps
+    long d = 0, alpha = 0, slope_abs = 0;
+
+    if (f->y < 0)                             // First sample, start on it instead of ramping up from 0
+        f->y = (long)x << AF_SHIFT;
+    d = ((long)x << AF_SHIFT) - f->y;
+    f->slope += (d - f->slope) / AF_SLOPE_DIV;
+    slope_abs = f->slope < 0 ? -f->slope : f->slope;
+    alpha = AF_ALPHA_MIN + ((slope_abs * AF_BETA) >> AF_SHIFT);
+    if (alpha > 256)
+        alpha = 256;
+    f->y += (alpha * d) / 256;
+    return (f->y + (1 << (AF_SHIFT - 1))) >> AF_SHIFT;
+}
+
+#endif
@@ -7,25 +7,54 @@
  *        IMPORTANT: Short the heads of JP201 for the buzzer to work for threshold warnings
  *        There are three "modes": Thermistor reading, potentiometer reading, and off.
  *        The modes are switched revolvingly using S101 on UK by pressing the button briefly
- *        Readings can be either in mV or 100xCelcius on the 7Seg, use READ_VOLTAGE_OR_DEG to compile accordingly
+ *        Readings can be either in mV or Celcius on the 7Seg, use READ_VOLTAGE_OR_DEG to compile accordingly
+ *        Celcius shows as many of its two decimals as fit (12.34, 123.4, -1.23, -12.3), with the decimal point lit
  *        The potentiometer can be used to set threshold, give TEMP_THRESHOLD_TOGGLE 1 to include this feature
  *        When the voltage set by the potentiometer is exceeded, the buzzer vibrates to give an alarm
  *        The buzzer routine can be used as a driver for a motor, if one is mounted on H202; it is connected to P1.6
+ *        P1.6 has three output modes (OUTPUT_MODE, or "o" over UART), all on the same threshold sense:
+ *            0: Thermostat, the buzzer/motor routine runs while the reading is above the potentiometer setting
+ *            1: PWM on TA0.1, duty proportional to how far above the setting the reading is (OUT_BAND steps to full)
+ *            2: Sigma-delta, the same duty as whole on/off slots of OUT_SD_SLOT ticks, for SSRs and heater elements
+ *        Temperatures come from a flash catalog of thermistor models (sensor_catalog[]), each ADC scan channel
+ *        (P1.3, P1.4, P1.5) selects its model at runtime, "t" over UART; conversion is one interpolated table lookup
+ *        Readings go through an adaptive low-pass (ADAPTIVE_FILTER), heavy smoothing while steady, opening up on slopes
+ *        An online thermal model predicts each reading from the last one and the P1.6 output, the residual statistics
+ *        are watched for heater/fan/sensor degradation and "DEGRADED" is sent over UART when they drift
+ *        Thermistor readings are kept in a history pyramid of 1s, 1min and 1h buckets (min/max/mean of ADC steps),
+ *        timed by the watchdog in interval mode, so a bucket spans wall time no matter how long the main loop takes,
+ *        the 1h buckets are also written to info flash segment D so they survive a reset
+ *        UART on the Launchpad backchannel (P1.1 RXD, P1.2 TXD, 9600 8N1) takes line commands:
+ *            h0, h1, h2: Dump the 1s, 1min, 1h history ring, oldest first, one "min max mean" line per bucket
+ *            hf:         Dump the 1h buckets persisted in flash
+ *            a:          Anomaly detector, "warn w_out w_temp w_bias res_mean res_var" (weights Q20, mean Q6, var Q12 steps)
+ *            o0, o1, o2: Select the output mode
+ *            t:          List each channel, "P1.x type bias_ohm supply_mV temp name", temp in 100x Celcius
+ *            t<x><n>:    Set channel P1.x to sensor type n, e.g. t31 for the thermistor input P1.3 to type 1
+ *            s:          Sync status, "seq thermistor pot period locked framed" for the last timed sample
+ *        Several boards can sample in lockstep, set SYNC_MODE and wire P2.2 of all boards (and GND) together:
+ *            The master samples on TA1 and pulses P2.2 at every sample, the pulses it skips carry its frame number
+ *            Slaves capture the pulse with TA1.1 and lock their own TA1 sample tick onto it (PI loop on phase and period),
+ *            then take over the master's seq from the frame numbers, all 16 bits; details in sync_pll.h
  *
- * Notes: 7Seg will not show a minus sign, no info given on the screen for the sign if the temperature goes below 0 Celcius.
+ * Notes: Below 0 Celcius the leftmost digit of the 7Seg shows a minus sign, the other three show 10x the magnitude (-27.4 as -274)
  *        Also, if the temperature exceeds 99.99 Celcius, the hundreds digit will not show on the screen
  *        This can be solved by printing values in Celcius proper, in XXX.X format using the dots of the 7Seg
  *        (The decimal dots are activated by flipping the least sig.fig. of a char to 1)
- *        If voltage of P1.3 is zeroed out, the 7Seg gets scrambled if the code is compiled with READ_VOLTAGE_OR_DEG 0
+ *        If voltage of P1.3 is zeroed out, the conversion clamps to 150.00 Celcius (shown as 5000) with READ_VOLTAGE_OR_DEG 0
  *        The code is not optimized for low power usage
  */
 
 #include <msp430.h>
-#include <math.h>                              // Need log()
+#include "sync_pll.h"
+#include "filter_adapt.h"
+#include "anom_model.h"
 
 #define READ_VOLTAGE_OR_DEG 1        // Toggle for troubleshoot: 1 for milivoltage, 0 for temp in 100x celcius for 7Seg display
 #define TEMP_THRESHOLD_TOGGLE 1      // 1: Use potentiometer as a temperature threshold toggle; 0: Do not
 #define BUZZER_LIMIT 5     // No. of consec times the buzzer is run after a reading exceeds threshold, before getting neglected
+#define ADAPTIVE_FILTER 1  // 1: Filter thermistor and potentiometer readings with filter_adapt(); 0: Use raw readings
+#define OUTPUT_MODE 0      // P1.6 output mode at reset: 0 thermostat, 1 PWM, 2 sigma-delta
 
 #define BEEP_TIME 1500                         // Beep time in cycles
 #define SOUND_DELAY 20                         // Tune here for different freqs of sound
@@ -34,31 +63,89 @@
 #define BEEP_TIME_MOD BEEP_TIME*TIMER_MOD_COEFF  // Beep time in cycles, corrected
 #define VOLTAGE_COEFF 2.96                   // Coeff for converting reading to voltage times 1000, theo:3.22, exper: 2.96
 #define EMPTY_X 10                       // Refers to the all-clear character
+#define MINUS_X 11                       // Refers to the minus sign
+#define DOT_X 16                         // Added to a character, lights its decimal point
 
-// Thermistor parameters for Steinhart-Hart Eqn
-#define L_1 13.69
-#define L_2 9.21
-#define L_3 5.125
-#define Y_1 -0.01818
-#define Y_2 0.04
-#define Y_3 0.006451
-#define G_2 ((Y_2-Y_1)/(L_2-L_1))
-#define G_3 ((Y_3-Y_1)/(L_3-L_1))
-#define C_COEFF (((G_3-G_2)/(L_3-L_2))/(L_1+L_2+L_3))
-#define B_COEFF (G_2 - C_COEFF*(L_1*L_1 + L_1*L_2 + L_2*L_2))
-#define A_COEFF (Y_1 - L_1*(B_COEFF + L_1*L_1*C_COEFF))
-// These coeffs seem not to behave as expected for the given thermistor, would advise recalibrating
-
-int degree_conv(double voltage);
+// P1.6 output modes, TA0 from SMCLK/8 = 2MHz
+#define OUT_THERMOSTAT 0
+#define OUT_PWM 1
+#define OUT_SIGMA_DELTA 2
+#define OUT_DUTY_MAX 256       // Duty is Q8
+#define OUT_BAND 32            // ADC steps above the setting for full duty
+#define OUT_PWM_PERIOD 250     // PWM period in TA0 ticks, 8kHz; max 256 keeps duty*period in 16 bits
+#define OUT_TICK 20000         // Sigma-delta tick in TA0 ticks, 10ms
+#define OUT_SD_SLOT 100        // Sigma-delta slot in ticks, 1s; duty resolves to 1/256 over a 256-slot window
+
+// History pyramid, each level folds in completed buckets of the level below it
+#define HIST_CLOCK 16000000UL  // SMCLK, Hz; the WDT interval tick is SMCLK/HIST_WDT_DIV, 2.048ms
+#define HIST_WDT_DIV 32768UL
+#define HIST_LEVELS 3          // 1s, 1min, 1h
+#define HIST_SEC_LEN 8         // Ring lengths in buckets, keep small, the G2553 has 512B of RAM
+#define HIST_MIN_LEN 8
+#define HIST_HOUR_LEN 4
+#define HIST_FLASH_ADDR 0x1000                 // Info segment D, 64 bytes
+#define HIST_FLASH_LEN 10                      // No. of 1h buckets that fit in segment D
+#define CMD_LEN 8                              // UART command line buffer size
+
+// Cross-board synchronized sampling on TA1 (SMCLK/8 = 2MHz ticks), sync line on P2.2, tuning in sync_pll.h
+#define SYNC_MODE 0             // 0: Off, sample once per main loop; 1: Master; 2: Slave
+
+// Thermistor catalog, tables share one code axis (2.96mV per ADC step), denser at the hot end where the curve bends:
+// 8 steps apart below code 64, 16 below 128, then 32 up to 1024; within 1C of the Beta model over -50..150C
+#define SENSOR_TYPES 4
+#define SENSOR_TABLE_LEN 41
+#define SENSOR_FINE_END 64                     // Codes below are 8 steps per segment, segments 0..7
+#define SENSOR_MID_END 128                     // Codes below are 16 steps per segment, segments 8..11
+#define SENSOR_MIN (-5000)                     // Output range, 100x Celcius
+#define SENSOR_MAX 15000
+
+struct hist_bucket {         // A closed bucket, unit: ADC steps
+    unsigned int min;
+    unsigned int max;
+    unsigned int mean;
+};
+
+struct hist_level {          // The open bucket of a level, aggregated incrementally
+    unsigned int min;
+    unsigned int max;
+    unsigned long sum;
+    unsigned long count;     // No. of samples folded in, an hour of a fast main loop overflows 16 bits
+    unsigned int inputs;     // No. of completed buckets of the level below folded in
+    unsigned int head;       // Next ring slot to be overwritten
+    unsigned int full;       // 1 once the ring has wrapped
+};
+
+struct sensor_model {         // Thermistor with its bias subcircuit, thermistor on the low side as subcircuit A2 at page 2
+    const char *name;
+    unsigned long bias;      // Bias resistance, ohm
+    unsigned int supply;     // Feed, mV
+    int table[SENSOR_TABLE_LEN]; // 100x Celcius on the code axis, unclamped so the 150C end interpolates straight
+};
+
+int degree_conv(unsigned int code, unsigned int type);
+void out_set_mode(unsigned int mode);
+void out_set_duty(unsigned int duty);
+void hist_fold(unsigned int lvl, unsigned int min, unsigned int max,
+               unsigned long sum, unsigned long count, unsigned int inputs);
+void hist_flash_write(const struct hist_bucket *bucket);
+void hist_dump(const struct hist_bucket *ring, unsigned int len, unsigned int start);
+void uart_init();
+void uart_putc(char c);
+void uart_puts(const char *str);
+void uart_putu(unsigned long number);
+void uart_puti(long number);
+void uart_command();
+void sync_init();
+void sync_sample_start();
 void buzz();
 int threshold_check(unsigned int input);
-void write_4digit(int number, int delay);
+void write_4digit(int number, unsigned int decimals, int delay);
 void inject_7seg(unsigned int d_1, unsigned int d_2,
                  unsigned int d_3, unsigned int d_4,
                  int delay);
 void write_7seg(int data, int index);
 unsigned int p1_samples[3] = {0,0,0};  //From the ADC readings, p1_samples[0] holds P1.5, p1_samples[2] holds P1.3
-const unsigned int index[11] = { // 7-Seg Mapping; Order of bits for 7-Seg is 0bABCDEFGP
+const unsigned int index[12] = { // 7-Seg Mapping; Order of bits for 7-Seg is 0bABCDEFGP
                                  // Using volatile results in glitches, so use const
     0b11111100, // 0
     0b01100000, // 1
@@ -71,17 +158,70 @@ const unsigned int index[11] = { // 7-Seg Mapping; Order of bits for 7-Seg is 0b
     0b11111110, // 8
     0b11110110, // 9
     0b00000000, // all-clear
+    0b00000010, // minus
+};
+
+struct filter_state filt_therm = {-1, 0};   // y < 0 marks an unprimed filter
+struct filter_state filt_pot = {-1, 0};
+
+const struct sensor_model sensor_catalog[SENSOR_TYPES] = { // Beta model tables, R25 equal to the bias resistance
+    {"B57891M103J", 10000, 3300, {                   // EPCOS 10K, B 3988K, the booster's thermistor
+         32767,  19903,  16287,  14404,  13155,  12230,  11499,  10898,  10388,   9557,   8894,
+          8344,   7873,   7096,   6465,   5931,   5467,   5052,   4676,   4330,   4007,   3703,
+          3414,   3137,   2869,   2608,   2352,   2100,   1849,   1599,   1346,   1090,    828,
+           557,    275,    -23,   -342,   -690,  -1078,  -1527,  -2071}},
+    {"NTCLE100E3103", 10000, 3300, {                 // Vishay 10K, B 3977K
+         32767,  19979,  16343,  14450,  13195,  12266,  11532,  10928,  10416,   9581,   8916,
+          8363,   7891,   7110,   6477,   5942,   5476,   5060,   4683,   4335,   4011,   3706,
+          3416,   3138,   2870,   2608,   2352,   2099,   1848,   1596,   1343,   1086,    823,
+           552,    269,    -30,   -349,   -698,  -1087,  -1536,  -2082}},
+    {"NCP18XH103", 10000, 3300, {                    // Murata 10K, B 3380K
+         32767,  25442,  20243,  17632,  15935,  14696,  13728,  12938,  12272,  11197,  10347,
+          9647,   9052,   8077,   7293,   6634,   6064,   5558,   5102,   4683,   4294,   3930,
+          3584,   3254,   2936,   2627,   2326,   2029,   1735,   1442,   1148,    850,    547,
+           234,    -91,   -432,   -797,  -1193,  -1633,  -2138,  -2749}},
+    {"NCP18WF104", 100000, 3300, {                   // Murata 100K, B 4250K, needs a 100K bias resistor
+         32767,  18263,  15078,  13402,  12283,  11450,  10790,  10246,   9783,   9027,   8422,
+          7918,   7487,   6772,   6190,   5697,   5267,   4882,   4533,   4211,   3910,   3626,
+          3356,   3097,   2846,   2601,   2361,   2124,   1889,   1653,   1415,   1173,    925,
+           669,    402,    120,   -183,   -513,   -883,  -1310,  -1830}},
 };
+unsigned int sensor_sel[3] = {0,0,0};  // Catalog index per channel, same order as p1_samples
+
+volatile unsigned int out_mode = OUT_THERMOSTAT;
+volatile unsigned int out_duty = 0;    // Q8, read by the sigma-delta slot ISR
+unsigned int out_acc = 0;              // Sigma-delta accumulator, ISR only
+unsigned int out_ticks = 0;            // Ticks into the current slot, ISR only
+
+struct anom_state anom = {{0,0,0}, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0};  // y_prev < 0 marks an unprimed model
+
+struct hist_level hist[HIST_LEVELS];
+struct hist_bucket hist_sec[HIST_SEC_LEN];
+struct hist_bucket hist_min[HIST_MIN_LEN];
+struct hist_bucket hist_hour[HIST_HOUR_LEN];
+struct hist_bucket * const hist_ring[HIST_LEVELS] = {hist_sec, hist_min, hist_hour};
+const unsigned int hist_len[HIST_LEVELS] = {HIST_SEC_LEN, HIST_MIN_LEN, HIST_HOUR_LEN};
+const unsigned int hist_span[HIST_LEVELS] = {1, 60, 60}; // Seconds, then buckets of the level below, per bucket
+volatile unsigned int hist_seconds = 0;  // Seconds elapsed since the main loop last closed a 1s bucket
+unsigned long hist_clock = 0;            // SMCLK cycles into the current second, WDT ISR only
+
+volatile char cmd_buf[CMD_LEN];        // Filled by the UART RX interrupt
+volatile unsigned int cmd_len = 0;
+volatile unsigned int cmd_ready = 0;   // Set when a full line is in cmd_buf, cleared by uart_command()
+
+volatile unsigned int sync_samples[3] = {0,0,0};  // p1_samples as converted at the sample tick tagged sync_sample_seq
+volatile unsigned int sync_sample_seq = 0;
+struct sync_pll sync;                             // Tick, PLL and seq state, TA1 ISRs only; read with interrupts off
 
 
 int main(void) {
-     int reading = 0, reading_pot = 0;
+     int reading = 0, reading_pot = 0, reading_raw = 0;
      unsigned int i = 0, buzz_ctr = 0, button = 0, button_ctr = 0;
-     double voltage = 0, voltage_pot = 0, voltage_act = 0, voltage_pot_act = 0;
+     double voltage = 0, voltage_pot = 0;
      int degree = 0;
      WDTCTL = WDTPW + WDTHOLD;                 // Stop the watch-dog timer
      ADC10CTL1 = INCH_5 + CONSEQ_1;            // Will read starting from P1.5 downward
-     ADC10CTL0 = ADC10SHT_2 + MSC + ADC10ON + ADC10IE;
+     ADC10CTL0 = ADC10SHT_2 + MSC + ADC10ON;   // No ADC10IE, GIE is on for UART RX and there is no ADC10 ISR
      ADC10DTC1 = 0x03;                         // 3 conversions
      ADC10AE0 |= 0x38;                         // P1.5,4,3 ADC10 option select
      ADC10SA = (unsigned int)p1_samples;       // Data from ADC is to be stored at p1_samples
@@ -94,7 +234,18 @@ int main(void) {
      BCSCTL1 = CALBC1_16MHZ;     // Set range
      DCOCTL = CALDCO_16MHZ;      // 1 cycle = 1s/16MHz = 62.5ns
 
+     uart_init();
+     WDTCTL = WDT_MDLY_32;                     // Watchdog as interval timer, SMCLK/32768, times the history
+     IE1 |= WDTIE;
+     out_set_mode(OUTPUT_MODE);
+     if (SYNC_MODE)
+         sync_init();
+     __bis_SR_register(GIE);
+
     for (;;) {
+        if (cmd_ready)
+            uart_command();
+
         // Button sense
         button = P2IN & 0x02;
         if (button == 0x00) {                 // Check if P2.1 is zero (S101 pressed)
@@ -104,40 +255,77 @@ int main(void) {
             for(i = WAIT_TIME; i > 0; i--);
             button = P2IN & 0x02;
         }
-        if (button_ctr % 3 == 2) {
-            inject_7seg(EMPTY_X, EMPTY_X, EMPTY_X, EMPTY_X, WAIT_TIME);
-            continue;
-        }
-
         // Temperature checking subroutine
-        ADC10CTL0 &= ~ENC;
-        while (ADC10CTL1 & BUSY);               // Wait if ADC10 core is active
-        ADC10SA = 0x200;                        // Data buffer start
-        P1OUT |= 0x01;                          // P1.0 set ON, signaling data acquisition
-        ADC10CTL0 |= ENC + ADC10SC;             // Sampling and conversion start
+        if (SYNC_MODE) {                        // Sampled on the TA1 tick, take the latest tagged sample
+            __disable_interrupt();
+            reading = sync_samples[2];
+            reading_pot = sync_samples[0];
+            __enable_interrupt();
+        }
+        else {
+            ADC10CTL0 &= ~ENC;
+            while (ADC10CTL1 & BUSY);               // Wait if ADC10 core is active
+            ADC10SA = (unsigned int)p1_samples;     // Data buffer start
+            P1OUT |= 0x01;                          // P1.0 set ON, signaling data acquisition
+            ADC10CTL0 |= ENC + ADC10SC;             // Sampling and conversion start
                // Not using interrupts here makes data acquisition significantly faster but makes readings slightly shaky (+- 10mV experimentally)
                // Talking about __bis_SR_register(CPUOFF + GIE)
-        reading = p1_samples[2];                // Reading voltage step of P1.3
-        reading_pot = p1_samples[0];            // Reading voltage step of P1.5 (potentiometer subcircuit)
-        P1OUT &= ~0x01;                         // P1.0 set OFF, signaling end of data acquisition
+            reading = p1_samples[2];                // Reading voltage step of P1.3
+            reading_pot = p1_samples[0];            // Reading voltage step of P1.5 (potentiometer subcircuit)
+            P1OUT &= ~0x01;                         // P1.0 set OFF, signaling end of data acquisition
+        }
+        reading_raw = reading;                  // The model takes it unfiltered, see anom_model.h
+        if (ADAPTIVE_FILTER) {
+            reading = filter_adapt(&filt_therm, reading);
+            reading_pot = filter_adapt(&filt_pot, reading_pot);
+        }
         voltage = reading * VOLTAGE_COEFF;      // Unit: mV
         voltage_pot = reading_pot * VOLTAGE_COEFF;
+        hist_fold(0, reading, reading, reading, 1, 0); // Into the open 1s bucket, closed by elapsed time below
+        __disable_interrupt();
+        i = hist_seconds;
+        hist_seconds = 0;
+        __enable_interrupt();
+        if (i)                                  // More than 1 if a dump or buzz() held the loop, one longer bucket
+            hist_fold(0, 0, 0, 0, 0, i);
+
+        // Off mode - history keeps running, the rest is skipped
+        if (button_ctr % 3 == 2) {
+            out_set_duty(0);                    // Off means P1.6 stays low in every output mode
+            anom.y_prev = -1;                   // No model updates while off, restart its difference chain
+            inject_7seg(EMPTY_X, EMPTY_X, EMPTY_X, EMPTY_X, WAIT_TIME);
+            continue;
+        }
+        if (anom_update(&anom, (long)reading_raw << AF_SHIFT))
+            uart_puts("DEGRADED\r\n");
+        anom.u = 0;                             // Output applied until the next sample, set below in every mode
+
+        // Output control for PWM/sigma-delta, before the potentiometer mode so the duty never goes stale
+        if (out_mode != OUT_THERMOSTAT) {       // Proportional duty, P1.6 is the load then, no alarm
+            if (reading <= reading_pot)
+                out_set_duty(0);
+            else if (reading - reading_pot >= OUT_BAND)
+                out_set_duty(OUT_DUTY_MAX);
+            else
+                out_set_duty((reading - reading_pot) * (OUT_DUTY_MAX / OUT_BAND));
+            anom.u = out_duty;
+        }
 
         // Button sense, potentiometer mode - show values corresponding to the potentiometer on 7Seg
         if (button_ctr % 3 == 1) {
             if(READ_VOLTAGE_OR_DEG)
-                write_4digit(voltage_pot, WAIT_TIME);
+                write_4digit(voltage_pot, 0, WAIT_TIME);
             else {
-                voltage_pot_act = voltage_pot/1000;
-                degree = degree_conv(voltage_pot_act);
-                write_4digit(degree, WAIT_TIME);
+                degree = degree_conv(reading_pot, sensor_sel[0]);
+                write_4digit(degree, 2, WAIT_TIME);
             }
             continue;
         }
 
-        // Temperature threshold control
-        if ((TEMP_THRESHOLD_TOGGLE) && (reading > reading_pot) && (buzz_ctr < BUZZER_LIMIT)) {
+        // Temperature threshold control, thermostat mode
+        if ((out_mode == OUT_THERMOSTAT) && (TEMP_THRESHOLD_TOGGLE) && (reading > reading_pot) && (buzz_ctr < BUZZER_LIMIT)) {
             buzz();
+            anom.u = 256;
             buzz_ctr += 1;
         }
         else if (reading > reading_pot) buzz_ctr += 1;
@@ -145,24 +333,372 @@ int main(void) {
 
         // 7SEG printing - Temperature reading off anyway, will just use reading to display
         if(READ_VOLTAGE_OR_DEG)
-            write_4digit(voltage, WAIT_TIME);
+            write_4digit(voltage, 0, WAIT_TIME);
         else {
-            voltage_act = voltage/1000;
-            degree = degree_conv(voltage_act);
-            write_4digit(degree, WAIT_TIME);
+            degree = degree_conv(reading, sensor_sel[2]);
+            write_4digit(degree, 2, WAIT_TIME);
         }
     }
 }
 
 
-int degree_conv(double voltage) { // Tuned for B57891M103J thermistor, subcircuit A2 at page 2, unit V for voltage
-    double degree = 0;
-    double resistance_therm = 10000*voltage/(3.3-voltage);  // Bias resistance 10Kohm, feed 3.3V
+int degree_conv(unsigned int code, unsigned int type) { // ADC steps to 100x Celcius, one interpolated lookup
+    const int *table = sensor_catalog[type].table;
+    unsigned int seg = 0, shift = 5;
+    long degree = 0;
+
+    if (code < SENSOR_FINE_END) {
+        shift = 3;
+        seg = code >> 3;
+    }
+    else if (code < SENSOR_MID_END) {
+        shift = 4;
+        seg = 8 + ((code - SENSOR_FINE_END) >> 4);
+    }
+    else
+        seg = 12 + ((code - SENSOR_MID_END) >> 5);
+    if (seg >= SENSOR_TABLE_LEN - 1)           // Only reachable for a code of 1024 and up
+        degree = table[SENSOR_TABLE_LEN - 1];
+    else
+        degree = table[seg] + (((long)(table[seg + 1] - table[seg]) * (code & ((1 << shift) - 1))) >> shift);
+    if (degree > SENSOR_MAX)
+        return SENSOR_MAX;
+    if (degree < SENSOR_MIN)
+        return SENSOR_MIN;
+    return degree;
+}
+
+
+void out_set_mode(unsigned int mode) { // Reconfigure TA0 and P1.6 for the output mode, starts at duty 0
+    TA0CTL = TACLR;                           // Stop
+    TA0CCTL0 = 0;
+    TA0CCTL1 = 0;
+    P1SEL &= ~0x40;
+    P1OUT &= ~0x40;
+    out_duty = 0;
+    out_acc = 0;
+    out_ticks = 0;
+    out_mode = mode;
+    if (mode == OUT_PWM) {
+        P1SEL |= 0x40;                        // P1.6 as TA0.1
+        TA0CCR0 = OUT_PWM_PERIOD - 1;
+        TA0CCR1 = 0;
+        TA0CCTL1 = OUTMOD_7;                  // Reset/set
+        TA0CTL = TASSEL_2 + ID_3 + MC_1;      // SMCLK/8, up mode
+    }
+    else if (mode == OUT_SIGMA_DELTA) {
+        TA0CCR0 = OUT_TICK - 1;
+        TA0CCTL0 = CCIE;
+        TA0CTL = TASSEL_2 + ID_3 + MC_1;
+    }
+}
+
+
+void out_set_duty(unsigned int duty) { // Q8, up to OUT_DUTY_MAX
+    out_duty = duty;
+    if (out_mode == OUT_PWM)
+        TA0CCR1 = (duty * OUT_PWM_PERIOD) >> 8;
+}
+
 
-    // Implementing the Steinhart-Hart Eqn:
-    double res_log = log(resistance_therm);
-    degree = 1/(A_COEFF + B_COEFF*res_log + C_COEFF*res_log*res_log*res_log);
-    return degree*100; // Return 100 times the degree as int
+#pragma vector=TIMER0_A0_VECTOR
+__interrupt void out_slot_isr(void) { // First-order sigma-delta, one add and one compare per slot
+    out_ticks += 1;
+    if (out_ticks < OUT_SD_SLOT)
+        return;
+    out_ticks = 0;
+    out_acc += out_duty;
+    if (out_acc >= OUT_DUTY_MAX) {
+        out_acc -= OUT_DUTY_MAX;
+        P1OUT |= 0x40;
+    }
+    else
+        P1OUT &= ~0x40;
+}
+
+
+void hist_fold(unsigned int lvl, unsigned int min, unsigned int max,
+               unsigned long sum, unsigned long count, unsigned int inputs) { // Fold samples into level lvl, then
+    struct hist_level *h = &hist[lvl];                                         // advance it by inputs, O(1) per level
+    struct hist_bucket *bucket;
+
+    if (count && (h->count == 0 || min < h->min))
+        h->min = min;
+    if (count && (h->count == 0 || max > h->max))
+        h->max = max;
+    h->sum += sum;
+    h->count += count;
+    h->inputs += inputs;
+    if (h->inputs < hist_span[lvl] || h->count == 0) // An empty bucket keeps collecting, only at boot
+        return;
+
+    bucket = &hist_ring[lvl][h->head];     // Bucket complete, close it into the ring
+    bucket->min = h->min;
+    bucket->max = h->max;
+    bucket->mean = h->sum / h->count;
+    h->head += 1;
+    if (h->head == hist_len[lvl]) {
+        h->head = 0;
+        h->full = 1;
+    }
+
+    if (lvl + 1 < HIST_LEVELS)
+        hist_fold(lvl + 1, h->min, h->max, h->sum, h->count, h->inputs / hist_span[lvl]);
+    else
+        hist_flash_write(bucket);
+    h->count = 0;
+    h->sum = 0;
+    h->inputs %= hist_span[lvl];           // Overshoot of a late close comes off the next bucket
+}
+
+
+void hist_flash_write(const struct hist_bucket *bucket) { // Append to segment D, erase it first when it is full
+    struct hist_bucket *slot = (struct hist_bucket *)HIST_FLASH_ADDR;
+    unsigned int i = 0, sr = __get_SR_register();
+
+    for (i = 0; i < HIST_FLASH_LEN && slot[i].min != 0xFFFF; i++); // First erased slot
+    if (!SYNC_MODE)    // Running from flash holds the CPU through the operation anyway; with sync on, leave GIE
+        __disable_interrupt(); // set so the TA1 ticks that came due are serviced (and caught up) right after
+    FCTL2 = FWKEY + FSSEL_1 + FN5 + FN2 + FN1 + FN0;    // Flash clock MCLK/40 = 400kHz, must be 257-476kHz
+    FCTL3 = FWKEY;                                      // Unlock
+    if (i == HIST_FLASH_LEN) {
+        FCTL1 = FWKEY + ERASE;
+        *(unsigned int *)HIST_FLASH_ADDR = 0;           // Dummy write starts the segment erase
+        i = 0;
+    }
+    FCTL1 = FWKEY + WRT;
+    slot[i].min = bucket->min;
+    slot[i].max = bucket->max;
+    slot[i].mean = bucket->mean;
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY + LOCK;
+    __bis_SR_register(sr & GIE);
+}
+
+
+void hist_dump(const struct hist_bucket *ring, unsigned int len, unsigned int start) { // Dump len buckets from start on
+    unsigned int i = 0;
+    for (i = 0; i < len; i++) {
+        const struct hist_bucket *bucket = &ring[(start + i) % len];
+        uart_putu(bucket->min);
+        uart_putc(' ');
+        uart_putu(bucket->max);
+        uart_putc(' ');
+        uart_putu(bucket->mean);
+        uart_puts("\r\n");
+    }
+}
+
+
+#pragma vector=WDT_VECTOR
+__interrupt void hist_tick_isr(void) { // WDT interval tick, counts whole seconds of SMCLK for the history
+    hist_clock += HIST_WDT_DIV;
+    if (hist_clock >= HIST_CLOCK) {
+        hist_clock -= HIST_CLOCK;
+        hist_seconds += 1;
+    }
+}
+
+
+void uart_init() { // USCI_A0 as 9600 8N1 UART from SMCLK, RX is interrupt driven
+    P1SEL |= 0x06;                            // P1.1 RXD, P1.2 TXD
+    P1SEL2 |= 0x06;
+    UCA0CTL1 |= UCSWRST;
+    UCA0CTL1 |= UCSSEL_2;                     // SMCLK
+    UCA0BR0 = 0x82;                           // 16MHz/9600 = 1666.67
+    UCA0BR1 = 0x06;
+    UCA0MCTL = UCBRS_6;                       // Modulation for the fractional part
+    UCA0CTL1 &= ~UCSWRST;
+    IE2 |= UCA0RXIE;
+}
+
+
+void uart_putc(char c) {
+    while (!(IFG2 & UCA0TXIFG));              // Wait for the TX buffer
+    UCA0TXBUF = c;
+}
+
+
+void uart_puts(const char *str) {
+    while (*str)
+        uart_putc(*str++);
+}
+
+
+void uart_putu(unsigned long number) { // Unsigned decimal, no padding
+    char digits[10];
+    unsigned int i = 0;
+    do {
+        digits[i++] = '0' + number % 10;
+        number /= 10;
+    } while (number);
+    while (i > 0)
+        uart_putc(digits[--i]);
+}
+
+
+void uart_puti(long number) { // Signed decimal, no padding
+    if (number < 0) {
+        uart_putc('-');
+        number = -number;
+    }
+    uart_putu(number);
+}
+
+
+void uart_command() { // Run the line in cmd_buf, then free the buffer for the RX interrupt
+    unsigned int lvl = 0;
+    const struct hist_bucket *flash = (const struct hist_bucket *)HIST_FLASH_ADDR;
+
+    if (cmd_buf[0] == 'h' && cmd_buf[1] >= '0' && cmd_buf[1] < '0' + HIST_LEVELS) {
+        lvl = cmd_buf[1] - '0';
+        if (hist[lvl].full)
+            hist_dump(hist_ring[lvl], hist_len[lvl], hist[lvl].head);
+        else
+            hist_dump(hist_ring[lvl], hist[lvl].head, 0);
+    }
+    else if (cmd_buf[0] == 'h' && cmd_buf[1] == 'f') {
+        for (lvl = 0; lvl < HIST_FLASH_LEN && flash[lvl].min != 0xFFFF; lvl++);
+        hist_dump(flash, lvl, 0);
+    }
+    else if (cmd_buf[0] == 'a') {
+        uart_putu(anom.warn);
+        for (lvl = 0; lvl < 3; lvl++) {
+            long w = anom.w[lvl] >> (ANOM_W_SHIFT - 20);   // Q20 is plenty for reading
+            uart_putc(' ');
+            if (w < 0)
+                uart_putc('-');
+            uart_putu(w < 0 ? -w : w);
+        }
+        uart_putc(' ');
+        if (anom.res_mean < 0)
+            uart_putc('-');
+        uart_putu((anom.res_mean < 0 ? -anom.res_mean : anom.res_mean) / ANOM_MEAN_DIV);
+        uart_putc(' ');
+        uart_putu(anom.res_var / ANOM_SLOW_DIV);
+        uart_puts("\r\n");
+    }
+    else if (cmd_buf[0] == 'o' && cmd_buf[1] >= '0' && cmd_buf[1] <= '0' + OUT_SIGMA_DELTA) {
+        out_set_mode(cmd_buf[1] - '0');
+        anom.u = 0;                           // The new mode starts at duty 0
+    }
+    else if (cmd_buf[0] == 't' && cmd_buf[1] == 0) {
+        for (lvl = 0; lvl < 3; lvl++) {
+            const struct sensor_model *model = &sensor_catalog[sensor_sel[lvl]];
+            uart_puts("P1.");
+            uart_putu(5 - lvl);
+            uart_putc(' ');
+            uart_putu(sensor_sel[lvl]);
+            uart_putc(' ');
+            uart_putu(model->bias);
+            uart_putc(' ');
+            uart_putu(model->supply);
+            uart_putc(' ');
+            uart_puti(degree_conv(SYNC_MODE ? sync_samples[lvl] : p1_samples[lvl], sensor_sel[lvl]));
+            uart_putc(' ');
+            uart_puts(model->name);
+            uart_puts("\r\n");
+        }
+    }
+    else if (cmd_buf[0] == 't' && cmd_buf[1] >= '3' && cmd_buf[1] <= '5'
+             && cmd_buf[2] >= '0' && cmd_buf[2] < '0' + SENSOR_TYPES)
+        sensor_sel[5 - (cmd_buf[1] - '0')] = cmd_buf[2] - '0';
+    else if (cmd_buf[0] == 's') {
+        unsigned int seq = 0, therm = 0, pot = 0, locked = 0, framed = 0;
+        unsigned long period = 0;
+        __disable_interrupt();
+        seq = sync_sample_seq;
+        therm = sync_samples[2];
+        pot = sync_samples[0];
+        period = sync.period;
+        locked = sync.locked;
+        framed = sync.framed;
+        __enable_interrupt();
+        uart_putu(seq);
+        uart_putc(' ');
+        uart_putu(therm);
+        uart_putc(' ');
+        uart_putu(pot);
+        uart_putc(' ');
+        uart_putu(period >> 4);
+        uart_putc(' ');
+        uart_putu(locked);
+        uart_putc(' ');
+        uart_putu(framed);
+        uart_puts("\r\n");
+    }
+    else
+        uart_puts("?\r\n");
+    cmd_len = 0;
+    cmd_ready = 0;
+}
+
+
+#pragma vector=USCIAB0RX_VECTOR
+__interrupt void uart_rx_isr(void) { // Collect one command line, dropped if the previous one is still pending
+    char c = UCA0RXBUF;
+    if (cmd_ready)
+        return;
+    if (c == '\r' || c == '\n') {
+        if (cmd_len > 0) {
+            cmd_buf[cmd_len] = 0;
+            cmd_ready = 1;
+        }
+    }
+    else if (cmd_len < CMD_LEN - 1)
+        cmd_buf[cmd_len++] = c;
+}
+
+
+void sync_init() { // TA1 free-running; CCR0 is the local sample tick, slaves capture the master edge on CCR1
+    sync_pll_init(&sync, SYNC_PERIOD);
+    TA1CTL = TASSEL_2 + ID_3 + MC_2 + TACLR;  // SMCLK/8 = 2MHz, continuous
+    TA1CCR0 = SYNC_PERIOD;
+    TA1CCTL0 = CCIE;
+    if (SYNC_MODE == 1) {
+        P2DIR |= 0x04;                        // P2.2 drives the sync line
+        P2OUT &= ~0x04;
+        sync.locked = 1;                      // The master is the reference
+        sync.framed = 1;
+    }
+    else {
+        P2SEL |= 0x04;                        // P2.2 as TA1.CCI1B
+        TA1CCTL1 = CM_1 + CCIS_1 + SCS + CAP + CCIE; // Capture rising edges
+    }
+}
+
+
+void sync_sample_start() { // Start the 3-channel scan into p1_samples
+    ADC10CTL0 &= ~ENC;
+    ADC10SA = (unsigned int)p1_samples;
+    ADC10CTL0 |= ENC + ADC10SC;
+}
+
+
+#pragma vector=TIMER1_A0_VECTOR
+__interrupt void sync_tick_isr(void) { // Local sample tick: latch the previous scan, start the next one
+    unsigned int pulse = 0;
+
+    if (SYNC_MODE == 1)                       // Decided first, the edge has to come right with the conversion start
+        pulse = sync_pll_pulse(&sync, TA1R);
+    sync_samples[0] = p1_samples[0];          // The scan takes ~20us, long done by now
+    sync_samples[1] = p1_samples[1];
+    sync_samples[2] = p1_samples[2];
+    sync_sample_seq = sync.seq;
+    sync_sample_start();
+    if (pulse) {
+        P2OUT |= 0x04;                        // Sync pulse, a few cycles wide
+        P2OUT &= ~0x04;
+    }
+    TA1CCR0 = sync_pll_tick(&sync, TA1R);     // Also catches up ticks missed behind a flash operation
+}
+
+
+#pragma vector=TIMER1_A1_VECTOR
+__interrupt void sync_edge_isr(void) { // Slave: master edge captured, steer the local tick onto it
+    if (TA1IV != 0x02)                        // Only CCR1 is enabled on this vector
+        return;
+    sync_pll_edge(&sync, TA1CCR1);
 }
 
 
@@ -177,11 +713,24 @@ void buzz() {              // Works the buzzer and P1.0 for BEEP_TIME duration
 }
 
 
-void write_4digit(int number, int delay) { // Decimal to 7Seg, truncates after the 4 least significant digits
-    unsigned int d_4 = number % 10;
-    unsigned int d_3 = (number / (10)) % 10;
-    unsigned int d_2 = (number / (100)) % 10;
-    unsigned int d_1 = (number / (1000)) % 10;
+void write_4digit(int number, unsigned int decimals, int delay) { // Decimal to 7Seg, truncates after the 4 least
+    unsigned int magnitude = number < 0 ? -number : number;         // significant digits; decimals: digits after the
+    unsigned int d_1 = 0, d_2 = 0, d_3 = 0, d_4 = 0;                 // point, shown with the decimal point lit
+
+    while (decimals > 0 && magnitude > (number < 0 ? 999 : 9999)) { // Drop decimals until it fits, negatives lose
+        magnitude /= 10;                                                 // a digit to the sign
+        decimals -= 1;
+    }
+    d_4 = magnitude % 10;
+    d_3 = (magnitude / (10)) % 10;
+    d_2 = (magnitude / (100)) % 10;
+    d_1 = number < 0 ? MINUS_X : (magnitude / (1000)) % 10;
+    if (decimals == 1)
+        d_3 += DOT_X;
+    else if (decimals == 2)
+        d_2 += DOT_X;
+    else if (decimals == 3)
+        d_1 += DOT_X;
 
     inject_7seg(d_1, d_2, d_3, d_4, WAIT_TIME);
 }
@@ -193,13 +742,13 @@ void inject_7seg(unsigned int d_1, unsigned int d_2,
                                                              // Write from left to right
     int i = 0;
     for(i = delay*0.4; i > 0; i--) {
-        write_7seg(index[d_1],4);
+        write_7seg(index[d_1 % DOT_X] | d_1 / DOT_X,4);
         __delay_cycles(10000);
-        write_7seg(index[d_2],3);
+        write_7seg(index[d_2 % DOT_X] | d_2 / DOT_X,3);
         __delay_cycles(10000);
-        write_7seg(index[d_3],2);
+        write_7seg(index[d_3 % DOT_X] | d_3 / DOT_X,2);
         __delay_cycles(10000);
-        write_7seg(index[d_4],1);
+        write_7seg(index[d_4 % DOT_X] | d_4 / DOT_X,1);
         __delay_cycles(10000);
     }
 }
@@ -0,0 +1,205 @@
+/* Cross-board sample sync
+ * Tick scheduling, PLL and sequence number handling for SYNC_MODE in main.c
+ * Pure functions on a struct sync_pll, no registers touched, so test/sync_sim.c can run several nodes on a host
+ *
+ * Timing: ticks are TA1 counts (SMCLK/8 = 2MHz); timer values and seq are unsigned short so they wrap at 16 bits
+ *         on the host too; a tick serviced up to one timer wrap (32ms) late, e.g. behind a flash erase, is caught up
+ * Framing: the master pulses on every sample except in a SYNC_FRAME-sample frame:
+ *            pos 0, 1:        no pulse, frame marker
+ *            pos 3, 5 .. 21:  pulse if bit (pos-3)/2 of the frame number (seq / SYNC_FRAME) is 1
+ *            everything else: pulse
+ *          so there are never two missing pulses in a row except at the marker
+ *          Slaves decode the frame number and take it over once two frames in a row decode consecutively,
+ *          after that their seq is the master's seq, all 16 bits
+ */
+
+#ifndef SYNC_PLL_H
+#define SYNC_PLL_H
+
+#define SYNC_PERIOD 20000       // Sample period in ticks, 10ms; max 32767
+#define SYNC_FRAME 64           // Samples per frame, the low 6 bits of seq
+#define SYNC_FRAME_BITS 10      // Frame number bits, the upper 10 bits of seq
+#define SYNC_KP_DIV 2           // PLL: 1/SYNC_KP_DIV of the phase error is taken out on the next tick
+#define SYNC_KI_DIV 16          // PLL: 1/SYNC_KI_DIV of the phase error goes into the period, tracks DCO drift
+#define SYNC_KI_MAX (SYNC_PERIOD / 64)      // Largest period step per edge, ticks
+#define SYNC_PERIOD_DEV (SYNC_PERIOD / 16)  // Period stays within this of SYNC_PERIOD, DCOs are within a few %
+#define SYNC_LOCK_TOL 8         // Locks once the master edge is within this many ticks (4us) of the local tick,
+#define SYNC_UNLOCK_TOL 64      // unlocks when it is this far off (32us), ISR latency jitter stays below that
+#define SYNC_BAD_EDGES 3        // Locked: edges this far off are dropped until this many come in a row
+#define SYNC_LATE_TOL 32        // Master: no pulse from a tick serviced later than this, e.g. behind a flash erase
+#define SYNC_MARGIN 64          // A compare closer than this to the timer is taken as missed (ISR exit takes ~15 ticks)
+
+struct sync_pll {
+    unsigned short seq;        // Seq of the conversion started at the last tick
+    unsigned short tick;       // Timer value the last tick was scheduled for
+    unsigned short next;       // Timer value of the next tick, the CCR0 value
+    unsigned long period;      // Local sample period, ticks in Q4
+    unsigned int frac;         // Q4 remainder carried between ticks
+    int corr;                  // Phase correction for the next tick
+    unsigned int skipped;      // Ticks given up for being too close, counted in seq at the next tick
+    unsigned int locked;
+    unsigned int bad;          // Edges dropped in a row while locked
+    unsigned short edge_seq;   // Seq the last master edge belonged to
+    unsigned int rx_gap;       // Missing pulses right before the slot being decoded
+    unsigned short rx_base;    // Seq of pos 0 of the frame being received
+    unsigned int rx_bits;      // Frame number bits received so far
+    unsigned int rx_valid;     // 1 while a frame is being received
+    unsigned int rx_last;      // Last frame number decoded
+    unsigned short rx_last_base; // and the seq of its pos 0
+    unsigned int rx_have;      // 1 once rx_last is set
+    unsigned int framed;       // 1 once seq is the master's seq
+};
+
+
+static void sync_pll_init(struct sync_pll *p, unsigned short first_tick) { // first_tick: timer value of the first tick
+    p->seq = 0;
+    p->tick = first_tick - SYNC_PERIOD;
+    p->next = first_tick;
+    p->period = (unsigned long)SYNC_PERIOD << 4;
+    p->frac = 0;
+    p->corr = 0;
+    p->skipped = 0;
+    p->locked = 0;
+    p->bad = 0;
+    p->edge_seq = 0;
+    p->rx_gap = 0;
+    p->rx_valid = 0;
+    p->rx_have = 0;
+    p->framed = 0;
+}
+
+
+static unsigned short sync_pll_tick(struct sync_pll *p, unsigned short now) { // At the tick ISR, now: timer,
+    unsigned short period = p->period >> 4;                                   // returns the next CCR0
+    unsigned long step = 0;
+
+    p->tick = p->next;                        // The tick being serviced
+    p->seq += 1 + p->skipped;
+    p->skipped = 0;
+    while ((unsigned short)(now - p->tick) >= period) { // Serviced a whole period late or more, the ticks
+        p->tick += period;                              // in between are lost but still count in seq
+        p->seq += 1;
+    }
+
+    step = p->frac + p->period;
+    p->next = p->tick + (unsigned short)(step >> 4) + p->corr;
+    p->frac = step & 15;
+    p->corr = 0;
+    while ((short)(p->next - now) < SYNC_MARGIN) { // Would be in the past by the time CCR0 is written, skip it,
+        p->next += period;                         // the next call counts it in seq
+        p->skipped += 1;
+    }
+    return p->next;
+}
+
+
+static unsigned int sync_pll_pulse(const struct sync_pll *p, unsigned short now) { // Master, before sync_pll_tick():
+    unsigned short seq = p->seq + 1;                                                // 1 if this tick gets a sync pulse
+    unsigned int pos = seq & (SYNC_FRAME - 1);
+
+    if ((unsigned short)(now - p->next) > SYNC_LATE_TOL) // A late edge would pull the slaves off, they hold over
+        return 0;
+
+    if (pos < 2)
+        return 0;
+    if (pos < 3 + 2 * SYNC_FRAME_BITS && (pos & 1))
+        return ((seq / SYNC_FRAME) >> ((pos - 3) / 2)) & 1;
+    return 1;
+}
+
+
+static unsigned short sync_pll_slot(struct sync_pll *p, unsigned short seq, unsigned int present) { // Decode one
+    unsigned short pos = 0, delta = 0;                                                        // slot, returns the seq shift
+
+    if (!present && p->rx_gap == 1) {         // Second missing pulse in a row, seq - 1 was pos 0
+        p->rx_base = seq - 1;
+        p->rx_bits = 0;
+        p->rx_valid = 1;
+        return 0;
+    }
+    if (!present && p->rx_gap > 1)            // More than the marker, the master stalled
+        p->rx_valid = 0;
+    if (!p->rx_valid)
+        return 0;
+    pos = seq - p->rx_base;
+    if (pos >= 3 + 2 * SYNC_FRAME_BITS)
+        return 0;
+    if (!(pos & 1)) {                         // Clock slots always carry a pulse
+        if (!present)
+            p->rx_valid = 0;
+        return 0;
+    }
+    if (present)
+        p->rx_bits |= 1 << ((pos - 3) / 2);
+    if (pos < 1 + 2 * SYNC_FRAME_BITS)
+        return 0;
+
+    p->rx_valid = 0;                          // Last bit, check against the previous frame
+    if (p->rx_have && p->rx_bits == ((p->rx_last + 1) & ((1 << SYNC_FRAME_BITS) - 1))
+        && (unsigned short)(p->rx_base - p->rx_last_base) == SYNC_FRAME) {
+        delta = p->rx_bits * SYNC_FRAME - p->rx_base;
+        p->seq += delta;
+        p->rx_base += delta;
+        p->framed = 1;
+    }
+    p->rx_last = p->rx_bits;
+    p->rx_last_base = p->rx_base;
+    p->rx_have = 1;
+    return delta;
+}
+
+
+static void sync_pll_edge(struct sync_pll *p, unsigned short edge) { // Slave: master edge captured at timer value edge
+    long period = p->period >> 4, err = (short)(edge - p->tick), step = 0;
+    unsigned short edge_seq = p->seq, gap = 0, slot = 0, delta = 0;
+
+    while (err > period / 2) {                // Fold into (-period/2, period/2], the sign decides the tick,
+        err -= period;                        // not which ISR ran first
+        edge_seq += 1;
+    }
+    while (err <= -period / 2) {
+        err += period;
+        edge_seq -= 1;
+    }
+
+    if (err >= SYNC_UNLOCK_TOL || err <= -SYNC_UNLOCK_TOL) { // A capture read behind a stall, or the master's
+        if (p->locked && ++p->bad < SYNC_BAD_EDGES)         // edge was; hold over, the decoder sees a gap
+            return;
+        p->locked = 0;                                      // Slipped, seq has to be taken over again
+        p->framed = 0;
+    }
+    p->bad = 0;
+
+    gap = edge_seq - p->edge_seq;
+    if (gap == 0)                             // Second edge on one tick, glitch
+        return;
+    if (gap > SYNC_FRAME)                     // Lost track, restart the decoder
+        p->rx_valid = 0;
+    else if (p->locked) {
+        p->rx_gap = 0;
+        for (slot = p->edge_seq + 1; slot != edge_seq; slot++) { // Slots without a pulse since the last edge
+            delta = sync_pll_slot(p, slot, 0);
+            slot += delta;                    // Keep counting in the realigned seq
+            edge_seq += delta;
+            p->rx_gap += 1;
+        }
+        edge_seq += sync_pll_slot(p, edge_seq, 1);
+    }
+    p->edge_seq = edge_seq;
+
+    step = err * 16 / SYNC_KI_DIV;
+    if (step > SYNC_KI_MAX * 16)
+        step = SYNC_KI_MAX * 16;
+    else if (step < -SYNC_KI_MAX * 16)
+        step = -SYNC_KI_MAX * 16;
+    p->period += step;
+    if (p->period > (unsigned long)(SYNC_PERIOD + SYNC_PERIOD_DEV) << 4)
+        p->period = (unsigned long)(SYNC_PERIOD + SYNC_PERIOD_DEV) << 4;
+    else if (p->period < (unsigned long)(SYNC_PERIOD - SYNC_PERIOD_DEV) << 4)
+        p->period = (unsigned long)(SYNC_PERIOD - SYNC_PERIOD_DEV) << 4;
+    p->corr = err / SYNC_KP_DIV;
+    if (err < SYNC_LOCK_TOL && err > -SYNC_LOCK_TOL)
+        p->locked = 1;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/* Host simulator for the degradation watch in anom_model.h
+ * Runs the main loop's chain on a simulated heater: raw reading with the booster's +-3 step ADC jitter (same noise
+ * model as test/filter_bench.c) -> filter_adapt() -> proportional P1.6 duty as in the PWM/sigma-delta output modes,
+ * while anom_update() sees the raw reading and the applied duty, one sample per main loop pass (~0.2s)
+ *     idle: heater off, constant 20C reading, nothing wrong
+ *     loop: closed loop holding the pot setting, the setting moved now and then, nothing wrong
+ *     drop: as loop, heater power halves at DROP_AT, has to warn within DETECT samples and not before
+ *
+ * Build and run from the repo root: gcc -O2 -o /tmp/anom_sim test/anom_sim.c && /tmp/anom_sim
+ * Exits with 1 on any false warning or a missed heater drop
+ */
+
+#include <stdio.h>
+#include "../filter_adapt.h"
+#include "../anom_model.h"
+
+#define SAMPLES 400000L         // ~22h per run
+#define DROP_AT 300000L
+#define DETECT 3000             // ~10min
+#define NOISE 3                 // Uniform jitter, +-steps
+#define AMBIENT 600.0           // Reading of the unheated plant, ADC steps (NTC: warmer reads lower)
+#define LOSS (1.0 / 1500)       // Heat loss per sample, ~5min time constant
+#define HEAT 0.2                // Reading change per sample at full duty, full power settles 300 steps down
+#define SETPOINT 450            // Pot reading, moved by SETPOINT_STEP every SETPOINT_EVERY samples
+#define SETPOINT_STEP 40
+#define SETPOINT_EVERY 40000L
+#define OUT_BAND 32             // As in main.c
+#define OUT_DUTY_MAX 256
+#define SEEDS 5
+
+enum { IDLE, LOOP, DROP, SCENARIOS };
+const char *scenario_name[SCENARIOS] = {"idle", "loop", "drop"};
+
+unsigned long lcg = 1;
+
+int noise(void) {
+    lcg = lcg * 1103515245UL + 12345UL;
+    return (int)((lcg >> 16) % (2 * NOISE + 1)) - NOISE;
+}
+
+
+int run(int scenario, unsigned long seed) { // Failures in one run
+    struct filter_state filt_therm = {-1, 0}, filt_pot = {-1, 0};
+    struct anom_state anom = {{0,0,0}, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    double y = AMBIENT, heat = HEAT;         // Starts cold, the warm-up run excites the model
+    long i = 0, first = -1;
+    int warns = 0, pot = SETPOINT;
+    unsigned int raw = 0, reading = 0, reading_pot = 0, duty = 0;
+
+    lcg = seed;
+    for (i = 0; i < SAMPLES; i++) {
+        if (scenario == IDLE)
+            pot = 700;                                // Setting above the reading, P1.6 stays off
+        else if (i % SETPOINT_EVERY == 0)
+            pot = SETPOINT + ((i / SETPOINT_EVERY) & 1) * SETPOINT_STEP;
+        if (scenario == DROP && i == DROP_AT)
+            heat = HEAT / 2;
+
+        raw = (unsigned int)(y + 0.5) + noise();
+        reading = filter_adapt(&filt_therm, raw);
+        reading_pot = filter_adapt(&filt_pot, pot + noise());
+        if (anom_update(&anom, (long)raw << AF_SHIFT)) {
+            warns += 1;
+            if (first < 0)
+                first = i;
+        }
+
+        if (reading <= reading_pot)                  // main.c's proportional duty
+            duty = 0;
+        else if (reading - reading_pot >= OUT_BAND)
+            duty = OUT_DUTY_MAX;
+        else
+            duty = (reading - reading_pot) * (OUT_DUTY_MAX / OUT_BAND);
+        anom.u = duty;
+        y += (AMBIENT - y) * LOSS - heat * duty / OUT_DUTY_MAX;
+    }
+
+    printf("  %s seed %lu: %d warnings, first at %ld\n", scenario_name[scenario], seed, warns, first);
+    if (scenario != DROP)
+        return warns != 0;
+    return first < DROP_AT || first >= DROP_AT + DETECT;
+}
+
+
+int main(void) {
+    unsigned long seed = 0;
+    int s = 0, failures = 0;
+
+    for (s = 0; s < SCENARIOS; s++)
+        for (seed = 1; seed <= SEEDS; seed++)
+            failures += run(s, seed);
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
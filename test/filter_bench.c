@@ -0,0 +1,110 @@
+/* Host benchmark for filter_adapt() in filter_adapt.h
+ * Runs the adaptive filter, a fixed 1/16 IIR (the adaptive filter's floor) and the raw readings over synthetic
+ * traces with the +-10mV ADC jitter of the booster (+-3 steps, uniform, seeded LCG so every host gives the same
+ * numbers), one sample per main loop pass:
+ *     flat: 500 steps, steady-state noise as the std dev of the output after it settled
+ *     jump: 300 -> 500 steps, samples until the output stays within 2 steps of 500
+ *     ramp: +0.2 steps per sample (~1 step/s, a heater warming up), mean lag behind the ramp in samples
+ *
+ * Build and run from the repo root: gcc -O2 -o /tmp/filter_bench test/filter_bench.c -lm && /tmp/filter_bench
+ * Exits with 1 if the adaptive filter is noisier than the fixed IIR on the flat trace, or not faster on the others
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "../filter_adapt.h"
+
+#define TRACE_LEN 4000
+#define SETTLE 1000             // Samples before a trace is measured, and the jump/ramp start
+#define NOISE 3                 // Uniform jitter, +-steps
+#define JUMP_FROM 300
+#define LEVEL 500
+#define RAMP_Q8 51              // Ramp slope in Q8 steps per sample, 0.2
+#define BAND 2                  // Jump settled once within this many steps for good
+#define FIXED_ALPHA 16          // Q8, the fixed IIR
+
+enum { FLAT, JUMP, RAMP, TRACES };
+enum { RAW, FIXED, ADAPT, FILTERS };
+const char *trace_name[TRACES] = {"flat", "jump", "ramp"};
+const char *filter_name[FILTERS] = {"raw", "iir 1/16", "adaptive"};
+
+unsigned long lcg = 1;
+
+int noise(void) {
+    lcg = lcg * 1103515245UL + 12345UL;
+    return (int)((lcg >> 16) % (2 * NOISE + 1)) - NOISE;
+}
+
+
+long truth(int trace, int i) { // Noise-free level in Q8 steps
+    if (trace == FLAT || i < SETTLE)
+        return (trace == JUMP ? JUMP_FROM : LEVEL) << 8;
+    if (trace == JUMP)
+        return LEVEL << 8;
+    return (LEVEL << 8) + (long)(i - SETTLE) * RAMP_Q8;
+}
+
+
+unsigned int fixed_iir(long *y, unsigned int x) { // Same Q6 layout and rounding as filter_adapt()
+    if (*y < 0)
+        *y = (long)x << AF_SHIFT;
+    *y += (((long)x << AF_SHIFT) - *y) * FIXED_ALPHA / 256;
+    return (*y + (1 << (AF_SHIFT - 1))) >> AF_SHIFT;
+}
+
+
+double run(int trace, int filter) { // The trace's figure of merit for one filter
+    struct filter_state f = {-1, 0};
+    long y = -1;
+    double sum = 0, sum2 = 0;
+    int i = 0, n = 0, settled = -1;
+
+    lcg = 1;                                  // Every filter sees the same noise
+    for (i = 0; i < TRACE_LEN; i++) {
+        long t = truth(trace, i);
+        unsigned int x = (t + 128) / 256 + noise(), out = x;
+
+        if (filter == FIXED)
+            out = fixed_iir(&y, x);
+        else if (filter == ADAPT)
+            out = filter_adapt(&f, x);
+        if (i < SETTLE)
+            continue;
+        if (trace == JUMP) {
+            if (out + BAND < LEVEL || out > LEVEL + BAND)
+                settled = -1;
+            else if (settled < 0)
+                settled = i - SETTLE;
+        }
+        else if (trace == RAMP && i >= 2 * SETTLE) {  // Past the start transient
+            sum += (t / 256.0 - out) * 256.0 / RAMP_Q8;
+            n += 1;
+        }
+        else if (trace == FLAT) {
+            sum += out;
+            sum2 += (double)out * out;
+            n += 1;
+        }
+    }
+    if (trace == JUMP)                        // -1: the noise alone keeps leaving the band
+        return settled > TRACE_LEN - 2 * SETTLE ? -1 : settled;
+    if (trace == RAMP)
+        return sum / n;
+    return sqrt(sum2 / n - (sum / n) * (sum / n));
+}
+
+
+int main(void) {
+    double r[TRACES][FILTERS];
+    int t = 0, k = 0, fail = 0;
+
+    printf("%-10s %12s %12s %12s\n", "", "flat std", "jump settle", "ramp lag");
+    for (k = 0; k < FILTERS; k++) {
+        for (t = 0; t < TRACES; t++)
+            r[t][k] = run(t, k);
+        printf("%-10s %12.3f %12.0f %12.1f\n", filter_name[k], r[FLAT][k], r[JUMP][k], r[RAMP][k]);
+    }
+    fail = r[FLAT][ADAPT] > r[FLAT][FIXED] || r[JUMP][ADAPT] >= r[JUMP][FIXED] || r[RAMP][ADAPT] >= r[RAMP][FIXED];
+    printf("%s\n", fail ? "FAIL" : "PASS");
+    return fail;
+}
@@ -0,0 +1,187 @@
+/* Host simulator for the cross-board sync in sync_pll.h
+ * One master and several slaves with skewed clocks, random ISR latency, random order of the TA1 tick and
+ * capture ISRs when both are pending, and stalls like a flash segment erase
+ *
+ * Build and run from the repo root: gcc -O2 -o /tmp/sync_sim test/sync_sim.c && /tmp/sync_sim
+ * Exits with 1 if any slave samples more than MAX_SKEW_STEPS away from the master's sample of the same seq,
+ * loses lock, or never takes over the master's seq
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../sync_pll.h"
+
+#define NODES 4                 // Node 0 is the master
+#define STEP_NS 500             // Simulation step, one nominal TA1 tick (2MHz)
+#define SIM_STEPS 80000000L     // 40s
+#define WARMUP_STEPS 20000000L  // 10s to lock and take over the seq
+#define MAX_SKEW_STEPS 32       // 16us
+#define SKEW_MAX 0.02           // DCO spread between boards, +-2%
+#define LATENCY_MIN 2           // ISR entry latency in steps
+#define LATENCY_MAX 12
+#define STALL_STEPS 52000       // 26ms, worst segment erase
+#define STALL_EVERY 4000000L    // Mean steps between stalls per node
+#define LATE_STEPS 200          // Samples taken this late (behind a stall) are not compared
+#define SEEDS 8
+#define MAX_REPORTS 5
+
+struct node {
+    double rate;                // Timer counts per step
+    double acc;
+    unsigned short timer;       // TA1R
+    unsigned short ccr0;
+    long boot;                  // Step the node starts at
+    long stall_until;           // ISRs held until this step
+    int tick_pending;
+    long tick_at;               // Step the ISR can run, CCIFG set plus latency
+    long tick_due;              // Step the compare matched
+    int cap_pending;
+    unsigned short cap;         // TA1CCR1
+    long cap_at;
+    struct sync_pll pll;
+};
+
+struct node nodes[NODES];
+long master_step[65536];        // Step the master started the conversion of each seq, -1 if none
+int master_late[65536];
+int failures = 0;
+int reported = 0;               // Failures printed in this run, capped at MAX_REPORTS
+
+long rnd(long n) {
+    return rand() % n;
+}
+
+
+int fail(void) {                // Counts a failure, 1 if it should still be printed
+    failures += 1;
+    return reported++ < MAX_REPORTS;
+}
+
+
+void service_tick(struct node *n, int id, long step) {
+    unsigned int pulse = 0, i = 0;
+    unsigned short seq = 0;
+
+    n->tick_pending = 0;
+    if (id == 0)
+        pulse = sync_pll_pulse(&n->pll, n->timer);
+    n->ccr0 = sync_pll_tick(&n->pll, n->timer);
+    seq = n->pll.seq;
+    if (id == 0) {
+        master_step[seq] = step;
+        master_late[seq] = step - n->tick_due > LATE_STEPS;
+        for (i = 1; pulse && i < NODES; i++) {   // The edge reaches every slave now, capture latches TA1R
+            if (step < nodes[i].boot)
+                continue;
+            nodes[i].cap = nodes[i].timer;
+            if (!nodes[i].cap_pending) {
+                nodes[i].cap_pending = 1;
+                nodes[i].cap_at = step + LATENCY_MIN + rnd(LATENCY_MAX - LATENCY_MIN);
+            }
+        }
+        return;
+    }
+    if (step < WARMUP_STEPS || step - n->tick_due > LATE_STEPS)
+        return;
+    if (!n->pll.framed) {
+        if (fail())
+            printf("  node %d: seq not taken over after warmup\n", id);
+    }
+    else if (master_step[seq] < 0 || master_late[seq]) // Master stalled on this one
+        return;
+    else if (labs(step - master_step[seq]) > MAX_SKEW_STEPS) {
+        if (fail())
+            printf("  node %d: seq %u sampled %ld steps from the master\n", id, seq, step - master_step[seq]);
+    }
+}
+
+
+void service_cap(struct node *n, int id, long step) {
+    n->cap_pending = 0;
+    sync_pll_edge(&n->pll, n->cap);
+    if (step > WARMUP_STEPS && !n->pll.locked) {
+        if (fail())
+            printf("  node %d: lost lock at step %ld\n", id, step);
+    }
+}
+
+
+int run(unsigned int seed) {
+    long step = 0;
+    int i = 0, fails_before = failures;
+
+    srand(seed);
+    reported = 0;
+    for (i = 0; i < 65536; i++)
+        master_step[i] = -1;
+    for (i = 0; i < NODES; i++) {
+        struct node *n = &nodes[i];
+        n->rate = 1.0 + (i ? SKEW_MAX * (2.0 * rand() / RAND_MAX - 1.0) : 0);
+        n->acc = 0;
+        n->timer = 0;
+        n->ccr0 = SYNC_PERIOD;
+        n->boot = i ? rnd(WARMUP_STEPS / 4) : 0;
+        n->stall_until = 0;
+        n->tick_pending = 0;
+        n->cap_pending = 0;
+        sync_pll_init(&n->pll, SYNC_PERIOD);
+    }
+    nodes[0].pll.seq = 65536 - 1500;          // Master wraps its seq mid-run
+    nodes[0].pll.locked = 1;
+    nodes[0].pll.framed = 1;
+
+    for (step = 0; step < SIM_STEPS; step++) {
+        for (i = 0; i < NODES; i++) {
+            struct node *n = &nodes[i];
+            int tick_ready = 0, cap_ready = 0;
+
+            if (step < n->boot)
+                continue;
+            n->acc += n->rate;
+            while (n->acc >= 1.0) {
+                n->acc -= 1.0;
+                n->timer += 1;
+                if (n->timer == n->ccr0 && !n->tick_pending) {
+                    n->tick_pending = 1;
+                    n->tick_due = step;
+                    n->tick_at = step + LATENCY_MIN + rnd(LATENCY_MAX - LATENCY_MIN);
+                }
+            }
+            if (step >= n->stall_until && rnd(STALL_EVERY) == 0) // One erase at a time
+                n->stall_until = step + STALL_STEPS;
+            if (step < n->stall_until)
+                continue;
+            tick_ready = n->tick_pending && step >= n->tick_at;
+            cap_ready = n->cap_pending && step >= n->cap_at;
+            if (tick_ready && cap_ready && rnd(2)) {  // Both pending, either order
+                service_cap(n, i, step);
+                service_tick(n, i, step);
+            }
+            else {
+                if (tick_ready)
+                    service_tick(n, i, step);
+                if (cap_ready)
+                    service_cap(n, i, step);
+            }
+        }
+    }
+
+    for (i = 1; i < NODES; i++)
+        printf("  node %d: skew %+.4f, period %lu.%02lu, locked %u, framed %u, seq %u (master %u)\n", i,
+               nodes[i].rate - 1.0, nodes[i].pll.period >> 4, (nodes[i].pll.period & 15) * 100 / 16,
+               nodes[i].pll.locked, nodes[i].pll.framed, nodes[i].pll.seq, nodes[0].pll.seq);
+    return failures - fails_before;
+}
+
+
+int main(void) {
+    unsigned int seed = 0;
+
+    for (seed = 1; seed <= SEEDS; seed++) {
+        printf("seed %u\n", seed);
+        if (run(seed))
+            printf("  FAILED\n");
+    }
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}